@@ -8,16 +8,42 @@
 # The procedure for the sync is:
 #
 # 1. Clone a copy of the GitHub gecko-dev repository to the "_cache" directory.
-# 2. Filter that repository using `git-filter-repo` and create a new local git
-#    repository with the filtered contents into a directory specified by the
-#    argument passed to this script. The filtered contents are determined
-#    by the configuration in `.github/sync/webrender.paths`.
-# 3. Reset the `upstream` branch in the target repository to the new filtered
+#    This is a blob-less partial clone, and only the blobs under the paths kept
+#    by `.github/sync/webrender.paths` are fetched, in one batch per sync.
+# 2. Filter that repository using `git-filter-repo` into a local bare git
+#    repository in the directory specified by the argument passed to this
+#    script. The filtered contents are determined by the configuration in
+#    `.github/sync/webrender.paths`.
+# 3. Build and benchmark the new filtered version against the current
+#    `upstream` branch with `.github/sync/verify.sh`, and stop if it doesn't
+#    build or regresses. Set `SYNC_SKIP_VERIFY` in the environment to skip this.
+# 4. Reset the `upstream` branch in the target repository to the new filtered
 #    version.
 #
+# Filtering is incremental. The filtered repository borrows its objects from
+# the cache through git alternates and keeps git-filter-repo's marks on the
+# state branch, so only the upstream commits that arrived since the last run
+# are exported. The upstream commit that was last filtered is recorded in
+# `UPSTREAM_COMMIT` in the filtered repository, along with a hash of
+# `webrender.paths` in `UPSTREAM_PATHS`. The whole history is filtered again
+# when there is no previous state, when `webrender.paths` changed, when
+# upstream history was rewritten, or when `SYNC_FULL` is set in the
+# environment.
+#
+# When the script exits, the wall-clock time of every step, the number of
+# commits filtered and of blobs fetched, the bytes fetched into the cache and
+# the sizes of the cache and the filtered repository are written as JSON to
+# `sync-stats.json`, or to the path in `SYNC_STATS`. A table with the same
+# numbers is appended to the GitHub step summary when running as an Action.
+#
 # Note that this script relies on the idea that filtering `gecko-dev` the same
 # way more than once will result in the same commit hashes, otherwise multiple
 # copies of the version control history will be included in the repository.
+# Incremental and full filters can disagree on merges at the boundary between
+# runs, see "Filtering upstream" below.
+# The push is refused if the new filtered history does not extend the current
+# `upstream` branch, unless the history was filtered again on purpose (because
+# `webrender.paths` changed or `SYNC_FULL` is set).
 #
 # [1]: <https://github.com/mozilla/gecko-dev/> mirrored from
 #      <https://hg.mozilla.org/mozilla-central>
@@ -31,7 +57,35 @@ cache_dir=$root_dir/_cache
 git_name="Webrender Upstream Sync"
 git_email="noreply@github.com"
 
+paths_file=$root_dir/.github/sync/webrender.paths
+
+# The branch in the filtered repository holding git-filter-repo's marks.
+state_branch=filter-repo-state
+
+# Statistics written by finish(). Sizes are in bytes and are left empty when
+# the script exits before measuring them.
+stats_file=${SYNC_STATS-$root_dir/sync-stats.json}
+step_times=$(mktemp)
+step_name=
+step_start=
+mode=unknown
+full_sync=
+force_allowed=
+upstream_commits_filtered=
+upstream_blobs_fetched=
+filtered_commits_pushed=
+upstream_bytes_fetched=
+upstream_size=
+filtered_size=
+
 step() {
+    now=$(date +%s)
+    if [ "$step_name" != '' ]; then
+        printf '%s\t%s\n' "$((now - step_start))" "$step_name" >> "$step_times"
+    fi
+    step_name=$*
+    step_start=$now
+
     if [ "${TERM-}" != '' ]; then
         tput setaf 12
     fi
@@ -41,6 +95,70 @@ step() {
     fi
 }
 
+# Prints the size of the packs in the upstream cache in bytes, including their
+# indexes.
+pack_size() {
+    echo $(($(git -C upstream count-objects -v | sed -n 's/^size-pack: //p') * 1024))
+}
+
+# Runs a git fetch in the upstream cache, adding the size of the packs it
+# received to upstream_bytes_fetched. Fetched objects are always kept as packs
+# and auto gc waits until the fetch has been measured, so the packs only grow
+# by what was transferred.
+measure_fetch() {
+    fetch_start=$(pack_size)
+    git -C upstream -c fetch.unpackLimit=1 -c gc.auto=0 "$@"
+    upstream_bytes_fetched=$((upstream_bytes_fetched + $(pack_size) - fetch_start))
+    git -C upstream gc --auto
+}
+
+# Prints the disk usage of a path in bytes, or nothing if it doesn't exist.
+size_of() {
+    if [ -e "$1" ]; then
+        echo $(($(du -sk -- "$1" | cut -f1) * 1024))
+    fi
+}
+
+finish() {
+    status=$?
+    step "Writing sync statistics"
+    >&2 printf 'Writing %s\n' "$stats_file"
+    jq -n --rawfile steps "$step_times" \
+        --arg status "$status" \
+        --arg mode "$mode" \
+        --arg upstream_commits_filtered "$upstream_commits_filtered" \
+        --arg upstream_blobs_fetched "$upstream_blobs_fetched" \
+        --arg filtered_commits_pushed "$filtered_commits_pushed" \
+        --arg upstream_bytes_fetched "$upstream_bytes_fetched" \
+        --arg upstream_size "$upstream_size" \
+        --arg filtered_size "$filtered_size" \
+        'def num: if . == "" then null else tonumber end;
+        {
+            status: ($status | num),
+            mode: $mode,
+            upstream_commits_filtered: ($upstream_commits_filtered | num),
+            upstream_blobs_fetched: ($upstream_blobs_fetched | num),
+            filtered_commits_pushed: ($filtered_commits_pushed | num),
+            upstream_bytes_fetched: ($upstream_bytes_fetched | num),
+            upstream_size: ($upstream_size | num),
+            filtered_size: ($filtered_size | num),
+            steps: [$steps | split("\n")[] | select(. != "") | split("\t")
+                | {name: .[1], seconds: (.[0] | tonumber)}]
+        }' > "$stats_file"
+    rm -f "$step_times"
+
+    if [ "${GITHUB_STEP_SUMMARY-}" != '' ]; then
+        jq -r '"## Upstream sync\n",
+            "| Statistic | Value |", "| --- | ---: |",
+            (to_entries[] | select(.key != "steps") | "| \(.key) | \(.value) |"),
+            "", "| Step | Seconds |", "| --- | ---: |",
+            (.steps[] | "| \(.name) | \(.seconds) |")' \
+            "$stats_file" >> "$GITHUB_STEP_SUMMARY"
+    fi
+    exit "$status"
+}
+trap finish EXIT
+
 step "Creating directory for filtered upstream repo if needed"
 mkdir -p "$1"
 cd -- "$1"
@@ -61,26 +179,142 @@ fi
 
 step "Cloning upstream if needed"
 if ! [ -e upstream ]; then
-    git clone --bare --single-branch --progress https://github.com/mozilla/gecko-dev.git upstream
+    git clone --bare --single-branch --filter=blob:none --progress https://github.com/mozilla/gecko-dev.git upstream
+    upstream_bytes_fetched=$(pack_size)
+else
+    upstream_bytes_fetched=0
 fi
 
 step "Updating upstream"
 branch=$(git -C upstream rev-parse --abbrev-ref HEAD)
-git -C upstream fetch origin $branch:$branch
+measure_fetch fetch origin +$branch:$branch
+upstream_commit=$(git -C upstream rev-parse "$branch")
+paths_hash=$(git hash-object "$paths_file")
+
+step "Creating filtered repository if needed"
+if ! [ -f "$filtered/HEAD" ]; then
+    git init --bare --initial-branch=master "$filtered"
+fi
+# Alternates hold absolute paths, so point them at wherever the cache was
+# restored this time.
+printf '%s\n' "$cache_dir/upstream/objects" > "$filtered/objects/info/alternates"
+
+step "Checking previous filter state"
+if [ "${SYNC_FULL-}" != '' ]; then
+    full_sync="requested with SYNC_FULL"
+    force_allowed=1
+elif ! [ -f "$filtered/UPSTREAM_COMMIT" ] || ! [ -f "$filtered/UPSTREAM_PATHS" ]; then
+    full_sync="no previous state"
+elif [ "$(cat "$filtered/UPSTREAM_PATHS")" != "$paths_hash" ]; then
+    full_sync="webrender.paths changed"
+    force_allowed=1
+elif ! git -C upstream merge-base --is-ancestor "$(cat "$filtered/UPSTREAM_COMMIT")" "$upstream_commit"; then
+    full_sync="upstream history was rewritten"
+fi
+
+if [ "$full_sync" != '' ]; then
+    >&2 printf 'Discarding previous filter state: %s\n' "$full_sync"
+    rm -f "$filtered/UPSTREAM_COMMIT" "$filtered/UPSTREAM_PATHS"
+    if git -C "$filtered" rev-parse --verify -q "refs/heads/$state_branch" > /dev/null; then
+        git -C "$filtered" update-ref -d "refs/heads/$state_branch"
+    fi
+    range=$upstream_commit
+    mode="full: $full_sync"
+else
+    mode=incremental
+    >&2 printf 'Resuming filter from %s\n' "$(cat "$filtered/UPSTREAM_COMMIT")"
+    range=$(cat "$filtered/UPSTREAM_COMMIT")..$upstream_commit
+fi
+
+step "Listing missing blobs under the synced paths"
+# This is required, not an optimisation. The filtered repository has no
+# promisor remote, so git never lazily fetches a blob that is missing from the
+# blob-less cache it borrows objects from: fast-import dies on the first kept
+# file whose blob isn't there. Only blobs under the kept paths are needed, so
+# fetch those in one batch. Renames and regex or glob filters can't be turned
+# into pathspecs, so only literal path filters are used here, and they must not
+# contain whitespace.
+pathspecs=$(sed -e '/^#/d' -e '/==>/d' -e '/^regex:/d' -e '/^glob:/d' \
+    -e 's/^literal://' -e '/^$/d' "$paths_file")
+if [ "$pathspecs" = '' ]; then
+    >&2 printf 'No literal paths in webrender.paths to fetch blobs for\n'
+    exit 1
+fi
+git -C upstream rev-list --objects --full-history --missing=print "$range" -- $pathspecs \
+    | sed -n 's/^?//p' > missing-blobs
+upstream_blobs_fetched=$(($(wc -l < missing-blobs)))
+
+step "Fetching missing blobs"
+>&2 printf 'Fetching %s blobs\n' "$upstream_blobs_fetched"
+if [ -s missing-blobs ]; then
+    # The same command git uses to fetch missing objects from a promisor.
+    measure_fetch -c fetch.negotiationAlgorithm=noop fetch origin --no-tags \
+        --no-write-fetch-head --recurse-submodules=no --filter=blob:none \
+        --stdin < missing-blobs
+fi
+rm missing-blobs
+
+step "Measuring upstream"
+upstream_size=$(size_of upstream)
+upstream_commits_filtered=$(git -C upstream rev-list --count "$range")
 
 step "Filtering upstream"
-# Cloning and filtering is much faster than git filter-repo --source --target.
-git clone upstream -- "$filtered"
-git -C "$filtered" filter-repo --force --paths-from-file "$root_dir/.github/sync/webrender.paths"
+# Filtering in place is much faster than git filter-repo --source --target, as
+# blobs are then only referenced by hash and never read. That is also what
+# makes the partial clone work, since only blobs under the kept paths are ever
+# looked up. `master` is pointed at the unfiltered upstream head and rewritten;
+# commits already listed in the marks are skipped and new commits get their
+# parents from the marks.
+#
+# This doesn't always match filtering the whole history. git-filter-repo treats
+# commits from earlier runs as parentless in its ancestry graph, so a merge
+# that becomes degenerate across the boundary between runs is kept, while a
+# full filter would prune it. This is common for autoland merges whose side
+# branch changes nothing under the kept paths. After the incremental state is
+# lost, a full filter may therefore not extend `upstream`, and the push is
+# refused until a full filter is forced with `SYNC_FULL`.
+git -C "$filtered" update-ref refs/heads/master "$upstream_commit"
+git -C "$filtered" filter-repo --force --refs master \
+    --state-branch "$state_branch" \
+    --paths-from-file "$paths_file"
+printf '%s\n' "$upstream_commit" > "$filtered/UPSTREAM_COMMIT"
+printf '%s\n' "$paths_hash" > "$filtered/UPSTREAM_PATHS"
+filtered_size=$(size_of "$filtered")
 
 step "Adding filtered repository as a remote"
 cd "$root_dir"
 git remote add filtered-upstream "$filtered"
-git fetch filtered-upstream
+git fetch filtered-upstream master
+
+step "Checking that the filtered history extends 'upstream'"
+push_flags=
+if git fetch origin +upstream:refs/remotes/origin/upstream; then
+    filtered_commits_pushed=$(git rev-list --count origin/upstream..filtered-upstream/master)
+    if ! git merge-base --is-ancestor origin/upstream filtered-upstream/master; then
+        if [ "$force_allowed" = '' ]; then
+            >&2 printf "Filtered history does not extend 'upstream', refusing to push\n"
+            exit 1
+        fi
+        push_flags=--force
+    fi
+else
+    filtered_commits_pushed=$(git rev-list --count filtered-upstream/master)
+fi
+
+step "Verifying filtered repository HEAD"
+if [ "${SYNC_SKIP_VERIFY-}" != '' ]; then
+    >&2 printf 'Skipping verification: SYNC_SKIP_VERIFY is set\n'
+elif [ "$filtered_commits_pushed" = 0 ]; then
+    >&2 printf 'Skipping verification: no new commits\n'
+elif git rev-parse --verify -q origin/upstream > /dev/null; then
+    "$root_dir/.github/sync/verify.sh" origin/upstream filtered-upstream/master
+else
+    "$root_dir/.github/sync/verify.sh" '' filtered-upstream/master
+fi
 
 step "Resetting 'upstream' branch to filtered repository HEAD"
 git switch -c upstream
 git reset --hard filtered-upstream/master
 
 step Pushing new 'upstream'
-git push -f origin upstream
+git push $push_flags origin upstream
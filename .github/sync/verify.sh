@@ -0,0 +1,139 @@
+#!/bin/sh
+# Usage: verify.sh <old-revision> <new-revision>
+#
+# Checks a newly filtered WebRender tree before `sync.sh` pushes it to the
+# `upstream` branch. Both revisions are checked out as worktrees under
+# "_verify", `swgl`, `webrender` and `wrench` are built in release mode, and
+# the wrench benchmarks are run with software rendering so that they exercise
+# SWGL and don't need a GPU. The peak resident set size of each run is
+# recorded as well.
+#
+# The results are compared with `compare-perf.jq` and a Markdown report is
+# written to `verify-report.md`, or to the path in `SYNC_VERIFY_REPORT`, and
+# appended to the GitHub step summary when running as an Action. The script
+# fails, holding the push, if the new revision doesn't build or benchmark, or
+# if the total time of a benchmark field grows by more than
+# `SYNC_TIME_THRESHOLD` percent (10 by default) or the peak RSS by more than
+# `SYNC_MEMORY_THRESHOLD` percent (10 by default).
+#
+# An empty old revision, or one that doesn't build or benchmark, only skips the
+# comparison: a broken baseline shouldn't block every later sync.
+set -eux
+
+old=$1
+new=$2
+
+root_dir=$(pwd)
+verify_dir=$root_dir/_verify
+report=${SYNC_VERIFY_REPORT-$root_dir/verify-report.md}
+time_threshold=${SYNC_TIME_THRESHOLD-10}
+memory_threshold=${SYNC_MEMORY_THRESHOLD-10}
+
+# Both revisions share the target directory, so dependencies are only built
+# once.
+export CARGO_TARGET_DIR="$verify_dir/target"
+
+step() {
+    if [ "${TERM-}" != '' ]; then
+        tput setaf 12
+    fi
+    >&2 printf '* %s\n' "$*"
+    if [ "${TERM-}" != '' ]; then
+        tput sgr0
+    fi
+}
+
+# Appends the report to the step summary.
+publish() {
+    if [ "${GITHUB_STEP_SUMMARY-}" != '' ]; then
+        cat "$report" >> "$GITHUB_STEP_SUMMARY"
+    fi
+}
+
+# Usage: bench <name> <revision>
+#
+# Builds a revision and benchmarks it, leaving the results in
+# "_verify/<name>.json" and the peak RSS in KiB in "_verify/<name>.rss".
+bench() {
+    # This runs as an if condition, where `set -e` has no effect.
+    tree=$verify_dir/$1
+    if [ -e "$tree" ]; then
+        git worktree remove --force "$tree" || return 1
+    fi
+    git worktree add --detach "$tree" "$2" || return 1
+
+    cargo build --release --manifest-path "$tree/Cargo.toml" \
+        -p swgl -p webrender -p wrench || return 1
+
+    # Paths in the benchmark lists are relative to the wrench directory.
+    (cd "$tree/wrench" && xvfb-run -a /usr/bin/time -f '%M' -o "$verify_dir/$1.rss" \
+        "$CARGO_TARGET_DIR/release/wrench" --software perf "$verify_dir/$1.json")
+}
+
+mkdir -p "$verify_dir"
+rm -f "$verify_dir"/*.json "$verify_dir"/*.rss
+new_commit=$(git rev-parse --short "$new")
+
+step "Benchmarking new revision $new_commit"
+if ! bench new "$new"; then
+    printf '## Upstream sync verification\n\n%s\n' \
+        "Building or benchmarking $new_commit failed, not pushing it." > "$report"
+    publish
+    exit 1
+fi
+
+old_commit=
+if [ "$old" != '' ]; then
+    old_commit=$(git rev-parse --short "$old")
+    step "Benchmarking old revision $old_commit"
+    if ! bench old "$old"; then
+        step "Building or benchmarking $old_commit failed, skipping the comparison"
+        old_commit=
+    fi
+fi
+
+if [ "$old_commit" = '' ]; then
+    printf '## Upstream sync verification\n\n%s\n' \
+        "$new_commit builds and benchmarks. There is no baseline to compare it with." > "$report"
+    publish
+    exit 0
+fi
+
+step "Comparing $old_commit with $new_commit"
+jq -n -f "$root_dir/.github/sync/compare-perf.jq" \
+    --slurpfile old "$verify_dir/old.json" \
+    --slurpfile new "$verify_dir/new.json" \
+    --arg old_rss "$(cat "$verify_dir/old.rss")" \
+    --arg new_rss "$(cat "$verify_dir/new.rss")" \
+    --arg time_threshold "$time_threshold" \
+    --arg memory_threshold "$memory_threshold" \
+    > "$verify_dir/comparison.json"
+
+jq -r --arg old "$old_commit" --arg new "$new_commit" \
+    --arg time_threshold "$time_threshold" \
+    --arg memory_threshold "$memory_threshold" '
+    def cell: if . == null then "-" elif type == "number" then . * 100 | round / 100 | tostring else . end;
+    def row: "| \(.name) | \(.old | cell) | \(.new | cell) | \(.change | cell) |";
+    "## Upstream sync verification\n",
+    "Benchmarks of \($old) (current `upstream`) and \($new) with software rendering.",
+    "Totals may grow by \($time_threshold)% and peak RSS by \($memory_threshold)%.\n",
+    "| Total | Old | New | Change (%) |", "| --- | ---: | ---: | ---: |",
+    (.totals[] | row),
+    (.memory | .name = "Peak RSS (KiB)" | row),
+    "\n<details><summary>All benchmarks</summary>\n",
+    "| Benchmark | Old | New | Change (%) |", "| --- | ---: | ---: | ---: |",
+    (.metrics[] | row),
+    "\n</details>\n",
+    if (.totals | length) == 0 then
+        "**No timings found in the benchmark results, not pushing.**"
+    elif .regressed then
+        "**Regressed past the threshold in " +
+            ([(.totals[] | select(.regressed) | .name),
+              (if .memory.regressed then "peak RSS" else empty end)] | join(", ")) +
+            ", not pushing.**"
+    else
+        "No regression past the thresholds."
+    end' "$verify_dir/comparison.json" > "$report"
+publish
+
+jq -e '(.totals | length) > 0 and (.regressed | not)' "$verify_dir/comparison.json" > /dev/null